@@ -0,0 +1,172 @@
+#include "li.h"
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <sys/stat.h>
+
+/*** script ***/
+
+// keys that can't be typed into a script directly are written as `<name>`,
+// e.g. `<C-s>` to save or `<Down>` to move the cursor
+static const std::unordered_map<std::string, int> key_names({
+    {"CR", '\r'},
+    {"Esc", '\x1b'},
+    {"Tab", '\t'},
+    {"BS", BACKSPACE},
+    {"Del", DEL_KEY},
+    {"Up", ARROW_UP},
+    {"Down", ARROW_DOWN},
+    {"Left", ARROW_LEFT},
+    {"Right", ARROW_RIGHT},
+    {"Home", HOME_KEY},
+    {"End", END_KEY},
+    {"PageUp", PAGE_UP},
+    {"PageDown", PAGE_DOWN},
+    {"lt", '<'}
+});
+
+// every byte of the script is a keypress, except for line breaks
+// which are skipped so that long scripts can be split into lines
+static int parseScript(const char *path, std::vector<int>& keys) {
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return -1;
+    std::string script;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+        script.append(buf, n);
+    fclose(fp);
+
+    for (size_t i = 0; i < script.size(); i++) {
+        char c = script[i];
+        if (c == '\n' || c == '\r')
+            continue;
+        if (c == '<') {
+            size_t end = script.find('>', i + 1);
+            if (end != std::string::npos) {
+                std::string name = script.substr(i + 1, end - i - 1);
+                if (name.size() == 3 && name[0] == 'C' && name[1] == '-') {
+                    keys.push_back(CTRL_KEY(name[2]));
+                    i = end;
+                    continue;
+                }
+                auto it = key_names.find(name);
+                if (it != key_names.end()) {
+                    keys.push_back(it->second);
+                    i = end;
+                    continue;
+                }
+            }
+        }
+        keys.push_back(c);  // same value `editorReadKey` would return
+    }
+    return 0;
+}
+
+// run the script on one file with this thread's own editor.
+// return an error message, or "" on success
+static std::string editorRunScript(const char *filename, const std::vector<int>& keys) {
+    E = editorConfig();
+    E.screenrows = LI_BATCH_ROWS;
+    E.screencols = LI_BATCH_COLS;
+    E.batch = true;
+    E.keys = &keys;
+    E.key_pos = 0;
+    E.quit = false;
+    if (editorOpen(filename) == -1)
+        return "can't open: " + std::string(strerror(errno));
+
+    while (!E.quit && E.key_pos < keys.size()) {
+        editorRefreshScreen();
+        editorProcessKeypress();
+    }
+    // like leaving the editor after a final save, unless the script quit with Ctrl-C
+    if (!E.quit && E.dirty && editorWriteRows(E.filename) == -1)
+        return "can't save! I/O error: " + std::string(strerror(errno));
+    return "";
+}
+
+/*** work-stealing pool ***/
+
+struct workQueue {
+    std::mutex lock;
+    std::deque<int> jobs;
+};
+
+// take the newest job of our own queue, or steal the oldest one from another worker.
+// no jobs are added after start, so empty queues everywhere means we are done
+static bool nextJob(std::vector<workQueue>& queues, int self, int& job) {
+    int n = queues.size();
+    for (int k = 0; k < n; k++) {
+        workQueue& q = queues[(self + k) % n];
+        std::lock_guard<std::mutex> guard(q.lock);
+        if (q.jobs.empty())
+            continue;
+        if (k == 0) {
+            job = q.jobs.back();
+            q.jobs.pop_back();
+        } else {
+            job = q.jobs.front();
+            q.jobs.pop_front();
+        }
+        return true;
+    }
+    return false;
+}
+
+int editorBatch(const char *script, int nfiles, char *files[]) {
+    std::vector<int> keys;
+    if (parseScript(script, keys) == -1) {
+        fprintf(stderr, "li: %s: %s\n", script, strerror(errno));
+        return 1;
+    }
+
+    // the same file listed twice (`f`, `./f` or a symlink) must only be edited once,
+    // or two workers would write it at the same time
+    std::vector<int> jobs;
+    std::set<std::pair<dev_t, ino_t>> seen;
+    for (int i = 0; i < nfiles; i++) {
+        struct stat st;
+        if (stat(files[i], &st) == 0 && !seen.insert(std::make_pair(st.st_dev, st.st_ino)).second)
+            continue;
+        jobs.push_back(i);  // files that can't be stat'ed fail in `editorOpen` instead
+    }
+
+    int nworkers = std::max(1, std::min((int)std::thread::hardware_concurrency(), (int)jobs.size()));
+    std::vector<workQueue> queues(nworkers);
+    for (int i = 0; i < (int)jobs.size(); i++)
+        queues[i % nworkers].jobs.push_back(jobs[i]);
+
+    std::vector<std::string> errors(nfiles);
+    auto worker = [&](int self) {
+        int job;
+        while (nextJob(queues, self, job)) {
+            // a script that breaks on one file must not take the rest of the run with it
+            try {
+                errors[job] = editorRunScript(files[job], keys);
+            } catch (const std::exception& e) {
+                errors[job] = "script failed, unsaved changes dropped: " + std::string(e.what());
+            } catch (...) {
+                errors[job] = "script failed, unsaved changes dropped";
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int i = 1; i < nworkers; i++)
+        threads.emplace_back(worker, i);
+    worker(0);  // the main thread works too
+    for (auto& t : threads)
+        t.join();
+
+    int failed = 0;
+    for (int i = 0; i < nfiles; i++) {
+        if (errors[i] != "") {
+            fprintf(stderr, "li: %s: %s\n", files[i], errors[i].c_str());
+            failed++;
+        }
+    }
+    return failed ? 1 : 0;
+}
@@ -1,10 +1,13 @@
 #include "li.h"
+#include <chrono>
+#include <thread>
 
 void editorFindCallback(const std::string& query, int key) {
-    // use static variable to save match position
-    static int last_match_cy = -1;
-    static int last_match_cx = 0;
-    static int direction = 1;
+    // use static variable to save match position,
+    // thread local since every batch worker has its own editor
+    static thread_local int last_match_cy = -1;
+    static thread_local int last_match_cx = 0;
+    static thread_local int direction = 1;
     if (key == '\r' || key == '\x1b') {
         last_match_cy = -1;
         last_match_cx = 0;
@@ -69,4 +72,147 @@ void editorFind() {
         E.col_offset = saved_col_offset;
         E.row_offset = saved_row_offset;
     }
-}
\ No newline at end of file
+}
+
+// replace every `query` in `s` in one pass, return the number of replacements
+static int replaceInString(std::string& s, const std::string& query, const std::string& replacement) {
+    size_t match = s.find(query);
+    if (match == std::string::npos)
+        return 0;
+    std::string replaced;
+    replaced.reserve(s.size());
+    size_t last = 0;
+    int count = 0;
+    while (match != std::string::npos) {
+        replaced.append(s, last, match - last);
+        replaced += replacement;
+        last = match + query.size();
+        count++;
+        match = s.find(query, last);
+    }
+    replaced.append(s, last, std::string::npos);
+    s.swap(replaced);
+    return count;
+}
+
+// replace in `rows` from `begin` on, rebuilding each changed row only once.
+// the rows are split into `nthreads` blocks that are replaced in parallel,
+// so this must not touch `E`
+static int replaceInRows(std::vector<erow>& rows, int begin, int nthreads,
+                         const std::string& query, const std::string& replacement) {
+    int n = std::max(0, (int)rows.size() - begin);
+    std::vector<int> counts(nthreads, 0);
+    auto worker = [&](int t) {
+        int lo = begin + (long long)n * t / nthreads;
+        int hi = begin + (long long)n * (t + 1) / nthreads;
+        for (int i = lo; i < hi; i++) {
+            int count = replaceInString(rows[i].chars, query, replacement);
+            if (count) {
+                editorRenderRow(rows[i]);
+                counts[t] += count;
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int t = 1; t < nthreads; t++)
+        threads.emplace_back(worker, t);
+    worker(0);
+    for (auto& thread : threads)
+        thread.join();
+
+    int total = 0;
+    for (int count : counts)
+        total += count;
+    return total;
+}
+
+// replace in all rows from `begin` on. big files are spread over threads,
+// except in batch mode, which already runs one file per thread
+static int editorReplaceRows(int begin, const std::string& query, const std::string& replacement) {
+    int nthreads = 1;
+    if (!E.batch) {
+        int n = std::max(0, (int)E.rows.size() - begin);
+        nthreads = std::max(1, std::min((int)std::thread::hardware_concurrency(), n / LI_REPLACE_GRAIN));
+    }
+    int total = replaceInRows(E.rows, begin, nthreads, query, replacement);
+    if (total) {
+        editorIndexInvalidate(begin);
+        E.dirty = true;
+    }
+    return total;
+}
+
+static thread_local bool replace_aborted = false;
+
+// only used to tell an escape apart from an empty replacement
+void editorReplaceCallback(const std::string&, int key) {
+    replace_aborted = key == '\x1b';
+}
+
+// go through the file from the top and ask for each match,
+// `a` replaces the current match and everything after it in one pass
+void editorReplace() {
+    int saved_cx = E.cx;
+    int saved_cy = E.cy;
+    int saved_col_offset = E.col_offset;
+    int saved_row_offset = E.row_offset;
+    std::string query = editorPrompt("Replace: ", editorFindCallback);
+    std::string replacement;
+    if (query != "")
+        replacement = editorPrompt("Replace " + query + " with: ", editorReplaceCallback, true);
+    if (query == "" || replace_aborted) { // return to old position
+        E.cx = saved_cx;
+        E.cy = saved_cy;
+        E.col_offset = saved_col_offset;
+        E.row_offset = saved_row_offset;
+        editorSetStatusMessage("Replace aborted");
+        return;
+    }
+
+    int count = 0;
+    int cy = 0;
+    size_t cx = 0;
+    bool replace_all = false;
+    double elapsed_ms = 0;
+    while (cy < (int)E.rows.size()) {
+        size_t match = E.rows[cy].chars.find(query, cx);
+        if (match == std::string::npos) {
+            cy++;
+            cx = 0;
+            continue;
+        }
+        E.cy = cy;
+        E.cx = (int)match;
+        editorSetStatusMessage("Replace? (y)es | (n)o | (a)ll | (q)uit");
+        editorRefreshScreen();
+        int c = editorReadKey();
+        if (c == 'y') {
+            E.rows[cy].chars.replace(match, query.size(), replacement);
+            editorUpdateRow(cy);
+            count++;
+            cx = match + replacement.size();
+        } else if (c == 'n') {
+            cx = match + query.size();
+        } else if (c == 'a') {
+            auto start = std::chrono::steady_clock::now();
+            erow& row = E.rows[cy];
+            std::string rest = row.chars.substr(match);
+            count += replaceInString(rest, query, replacement);
+            row.chars.replace(match, std::string::npos, rest);
+            editorUpdateRow(cy);
+            count += editorReplaceRows(cy + 1, query, replacement);
+            elapsed_ms = std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - start).count();
+            replace_all = true;
+            break;
+        } else if (c == 'q' || c == '\x1b') {
+            break;
+        }
+    }
+    if (E.cy < (int)E.rows.size())
+        E.cx = std::min(E.cx, (int)E.rows[E.cy].chars.size());
+    std::string msg = std::to_string(count) + " occurrences replaced";
+    if (replace_all)
+        msg += " in " + std::to_string((long long)elapsed_ms) + " ms";
+    editorSetStatusMessage(msg);
+}
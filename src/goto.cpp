@@ -0,0 +1,56 @@
+#include "li.h"
+
+// put the cursor at (cy, cx) and show that row in the middle of the screen
+static void editorJumpTo(int cy, int cx) {
+    E.cy = cy;
+    E.cx = cx;
+    E.row_offset = std::max(0, cy - E.screenrows / 2);
+}
+
+// parse a decimal number, or a hex one starting with `0x` as found in crash reports.
+// return -1 if it is not a valid number
+static long long parseNumber(const std::string& s) {
+    const char *start = s.c_str();
+    int base = 10;
+    if (s.size() > 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+        start += 2;
+        base = 16;
+    }
+    char *end;
+    errno = 0;
+    long long n = strtoll(start, &end, base);
+    if (end == start || *end != '\0' || errno != 0 || n < 0)
+        return -1;
+    return n;
+}
+
+void editorGotoLine() {
+    std::string input = editorPrompt("Go to line: ", nullptr);
+    if (input == "" || E.rows.size() == 0)
+        return;
+    long long line = parseNumber(input);
+    if (line < 1) {
+        editorSetStatusMessage("Invalid line number: " + input);
+        return;
+    }
+    editorJumpTo((int)std::min(line, (long long)E.rows.size()) - 1, 0);
+}
+
+// jump to a byte offset of the file, like the ones from `grep -b`
+void editorGotoOffset() {
+    std::string input = editorPrompt("Go to byte offset: ", nullptr);
+    if (input == "" || E.rows.size() == 0)
+        return;
+    long long offset = parseNumber(input);
+    if (offset < 0) {
+        editorSetStatusMessage("Invalid byte offset: " + input);
+        return;
+    }
+    long long col;
+    int cy = editorOffsetToRow(offset, &col);
+    if (cy == (int)E.rows.size()) {  // past the end, go to the last byte
+        cy--;
+        col = E.rows[cy].chars.size();
+    }
+    editorJumpTo(cy, (int)std::min(col, (long long)E.rows[cy].chars.size()));
+}
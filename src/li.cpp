@@ -1,10 +1,13 @@
 #include "li.h"
 
 /*** data ***/
-editorConfig E;
+thread_local editorConfig E;
 
 std::unordered_map<int, void(*)()> short_cuts({
-    {CTRL_KEY('f'), editorFind}
+    {CTRL_KEY('f'), editorFind},
+    {CTRL_KEY('r'), editorReplace},
+    {CTRL_KEY('g'), editorGotoLine},
+    {CTRL_KEY('o'), editorGotoOffset}
 });
 
 /*** terminal ***/
@@ -59,6 +62,11 @@ void enableRawMode() {
 
 // wait for one keypress and return
 int editorReadKey() {
+    if (E.keys != nullptr) {  // batch mode, a script that runs out acts as escape
+        if (E.key_pos < E.keys->size())
+            return (*E.keys)[E.key_pos++];
+        return '\x1b';
+    }
     int nread;
     char c;
     while((nread = read(STDIN_FILENO, &c, 1)) != 1) {
@@ -118,67 +126,161 @@ int getWindowSize(int *rows, int *cols) {
     }
 }
 
+/*** line index ***/
+static long long rowBytes(int at) {
+    return E.rows[at].chars.size() + E.rows[at].eol.size();
+}
+
+// sum of the first `i` rows, without checking that the tree is up to date
+static long long indexSum(int i) {
+    long long sum = 0;
+    for (; i > 0; i -= i & -i)
+        sum += E.index.tree[i];
+    return sum;
+}
+
+// recompute the nodes after `valid`. node i holds its own row plus its
+// children i-1, i-2, i-4, ... below lowbit(i), which are all done before it
+static void editorIndexRebuild() {
+    lineIndex& index = E.index;
+    int n = E.rows.size();
+    if (index.valid == n && (int)index.tree.size() == n + 1)
+        return;
+    index.tree.resize(n + 1);
+    for (int i = index.valid + 1; i <= n; i++) {
+        index.tree[i] = rowBytes(i - 1);
+        for (int step = 1; step < (i & -i); step <<= 1)
+            index.tree[i] += index.tree[i - step];
+    }
+    index.valid = n;
+}
+
+// rows from `at` on were inserted, deleted or changed in bulk
+void editorIndexInvalidate(int at) {
+    E.index.valid = std::max(0, std::min(E.index.valid, at));
+}
+
+// the length of row `at` changed
+static void editorIndexUpdate(int at) {
+    lineIndex& index = E.index;
+    if (at + 1 > index.valid)  // will be rebuilt anyway
+        return;
+    long long delta = rowBytes(at) - (indexSum(at + 1) - indexSum(at));
+    for (int i = at + 1; i < (int)index.tree.size(); i += i & -i)
+        index.tree[i] += delta;
+}
+
+// byte offset of the start of row `at`, or the file size for `at == E.rows.size()`
+long long editorRowOffset(int at) {
+    editorIndexRebuild();
+    return indexSum(at);
+}
+
+// find the row holding byte `offset` by walking down the tree.
+// `col` is the offset inside that row. return E.rows.size() if it is past the end
+int editorOffsetToRow(long long offset, long long *col) {
+    editorIndexRebuild();
+    int n = E.rows.size();
+    int mask = 1;
+    while (mask * 2 <= n)
+        mask *= 2;
+    int pos = 0;  // number of rows that end before `offset`
+    for (; n > 0 && mask > 0; mask >>= 1) {
+        if (pos + mask <= n && E.index.tree[pos + mask] <= offset) {
+            pos += mask;
+            offset -= E.index.tree[pos];
+        }
+    }
+    *col = offset;
+    return pos;
+}
+
 /*** row operation ***/
-void editorUpdateRow(erow& row) {
-    row.render = "";
+// rebuild `render` from `chars`. doesn't touch `E`, so it is safe to call from other threads
+void editorRenderRow(erow& row) {
+    row.render.clear();
+    row.render.reserve(row.chars.size());
     for (int j = 0; j < (int)row.chars.size(); j++) {
         if(row.chars[j] == '\t')
-            row.render += std::string(LI_TAB, ' ');
+            row.render.append(LI_TAB, ' ');
         else
             row.render += row.chars[j];
     }
+}
+
+void editorUpdateRow(int at) {
+    if (at < 0 || at >= (int)E.rows.size()) return;
+    editorRenderRow(E.rows[at]);
+    editorIndexUpdate(at);
     E.dirty = true;
 }
 
-void editorInsertRow(int at, const std::string& s) {
+void editorInsertRow(int at, const std::string& s, const std::string& eol) {
     if (at < 0 || at > (int)E.rows.size()) return;
+    editorIndexInvalidate(at);
+    // only the last row may lack a terminator
+    if (at == (int)E.rows.size() && at > 0 && E.rows[at-1].eol == "") {
+        E.rows[at-1].eol = E.newline;
+        editorIndexInvalidate(at-1);
+    }
     if(at == (int)E.rows.size())
         E.rows.push_back(erow());
     else
         E.rows.insert(E.rows.begin() + at, erow());
     E.rows[at].chars = s;
-    editorUpdateRow(E.rows[at]);
+    E.rows[at].eol = eol;
+    editorUpdateRow(at);
 }
 
 void editorDelRow(int at) {
     if (at < 0 || at >= (int)E.rows.size()) return;
+    editorIndexInvalidate(at);
     E.rows.erase(E.rows.begin() + at);
     E.dirty = true;
 }
 
-void editorRowInsertChar(erow& row, int at, int c) {
-    if (at < 0 || at > (int)row.chars.size())
-        at = row.chars.size();
-    row.chars.insert(at, 1, c);
+// the row operations take the index of the row, which the line index needs
+void editorRowInsertChar(int row, int at, int c) {
+    std::string& chars = E.rows[row].chars;
+    if (at < 0 || at > (int)chars.size())
+        at = chars.size();
+    chars.insert(at, 1, c);
     editorUpdateRow(row);
 }
 
-void editorRowAppendString(erow& row, std::string& s) {
-    row.chars += s;
+void editorRowAppendString(int row, std::string& s) {
+    E.rows[row].chars += s;
     editorUpdateRow(row);
 }
 
-void editorRowDelChar(erow& row, int at) {
-    if (at < 0 || at >= (int)row.chars.size()) return;
-    row.chars.erase(at, 1);
+void editorRowDelChar(int row, int at) {
+    std::string& chars = E.rows[row].chars;
+    if (at < 0 || at >= (int)chars.size()) return;
+    chars.erase(at, 1);
     editorUpdateRow(row);
 }
 
 /*** editor operations ***/
 void editorInsertChar(int c) {
     if (E.cy == (int)E.rows.size())
-        editorInsertRow(E.rows.size(), "");
-    editorRowInsertChar(E.rows[E.cy], E.cx, c);
+        editorInsertRow(E.rows.size(), "", E.newline);
+    editorRowInsertChar(E.cy, E.cx, c);
     E.cx++;
 }
 
 void editorInsertNewline() {
+    // `cx` can point into `render`, which is longer than `chars` when the row has tabs
+    if (E.cy < (int)E.rows.size())
+        E.cx = std::min(E.cx, (int)E.rows[E.cy].chars.size());
     if (E.cx == 0) {
-        editorInsertRow(E.cy, "");
+        editorInsertRow(E.cy, "", E.newline);
     } else {
-        editorInsertRow(E.cy+1, E.rows[E.cy].chars.substr(E.cx));
+        // the second half keeps the terminator of the line, copied before the rows move
+        std::string eol = E.rows[E.cy].eol;
+        editorInsertRow(E.cy+1, E.rows[E.cy].chars.substr(E.cx), eol);
         E.rows[E.cy].chars = E.rows[E.cy].chars.substr(0, E.cx);
-        editorUpdateRow(E.rows[E.cy]);
+        E.rows[E.cy].eol = E.newline;
+        editorUpdateRow(E.cy);
     }
     E.cy++;
     E.cx = 0;
@@ -188,43 +290,159 @@ void editorDelChar() {
     if (E.cy == (int)E.rows.size()) return;
     if (E.cy == 0 && E.cx == 0) return;
     if (E.cx > 0) {
-        editorRowDelChar(E.rows[E.cy], E.cx-1);
+        editorRowDelChar(E.cy, E.cx-1);
         E.cx--;
     } else {
         E.cx = E.rows[E.cy-1].chars.size();
-        editorRowAppendString(E.rows[E.cy-1], E.rows[E.cy].chars);
+        E.rows[E.cy-1].eol = E.rows[E.cy].eol;
+        editorRowAppendString(E.cy-1, E.rows[E.cy].chars);
         editorDelRow(E.cy);
         E.cy--;
     }
 }
 
 /*** file IO ***/
-void editorOpen(const char *filename) {
+int editorOpen(const char *filename) {
     E.filename = std::string(filename);
     FILE *fp = fopen(filename, "r");
     if(!fp) 
-        die("fopen");
+        return -1;
 
     char *line = NULL;
     size_t linecap = 0;
     ssize_t linelen;
+    E.newline = "\n";
     while((linelen = getline(&line, &linecap, fp)) != -1) {
-        while (linelen > 0 && (line[linelen - 1] == '\n' ||
-                               line[linelen - 1] == '\r'))
-            linelen--;
-        editorInsertRow(E.rows.size(), std::string(line, linelen));
+        ssize_t textlen = linelen;
+        while (textlen > 0 && (line[textlen - 1] == '\n' ||
+                               line[textlen - 1] == '\r'))
+            textlen--;
+        // keep the terminator, so byte offsets and saving match the file on disk
+        std::string eol(line + textlen, linelen - textlen);
+        if (E.rows.size() == 0 && eol != "")
+            E.newline = eol;
+        editorInsertRow(E.rows.size(), std::string(line, textlen), eol);
     }
     free(line);
     fclose(fp);
     E.dirty = false;
+    return 0;
+}
+
+// write all of `buf` even if `write` only takes part of it
+static bool writeAll(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+// stream the rows to `fd` in chunks instead of joining them into one string first
+static bool writeRows(int fd) {
+    std::string chunk;
+    chunk.reserve(LI_WRITE_CHUNK);
+    for (const erow& row : E.rows) {
+        size_t row_len = row.chars.size() + row.eol.size();
+        if (chunk.size() + row_len > (size_t)LI_WRITE_CHUNK) {
+            if (!writeAll(fd, chunk.data(), chunk.size()))
+                return false;
+            chunk.clear();
+        }
+        if (row_len > (size_t)LI_WRITE_CHUNK) {  // too long to buffer
+            if (!writeAll(fd, row.chars.data(), row.chars.size()) ||
+                !writeAll(fd, row.eol.data(), row.eol.size()))
+                return false;
+        } else {
+            chunk += row.chars;
+            chunk += row.eol;
+        }
+    }
+    return writeAll(fd, chunk.data(), chunk.size());
+}
+
+// overwrite the file itself, which keeps its inode, links, owner and ACLs,
+// but leaves it truncated if the write fails halfway
+static bool writeInPlace(const std::string& target, size_t len) {
+    int fd = open(target.c_str(), O_WRONLY);
+    if (fd == -1)
+        return false;
+    // set the file's size to specified length
+    bool ok = ftruncate(fd, len) == 0 && writeRows(fd) && fsync(fd) == 0;
+    int saved_errno = errno;
+    if (close(fd) == -1 && ok) {
+        ok = false;
+        saved_errno = errno;
+    }
+    errno = saved_errno;
+    return ok;
 }
 
-std::string editorRowsToString() {
-    std::string buf;
-    for(auto row : E.rows) {
-        buf += row.chars + "\n";
+// stream the rows into a temporary file next to `filename` and rename it over the
+// original, so a failed write never leaves a truncated file behind.
+// return the number of bytes written, or -1 with `errno` set
+ssize_t editorWriteRows(const std::string& filename) {
+    // write beside the real file, so symlinks are kept and `rename` stays on one file system
+    std::string target = filename;
+    char *resolved = realpath(filename.c_str(), nullptr);
+    if (resolved != nullptr) {
+        target = resolved;
+        free(resolved);
+    }
+    size_t len = 0;
+    for (const erow& row : E.rows)
+        len += row.chars.size() + row.eol.size();
+
+    struct stat st;
+    bool exists = stat(target.c_str(), &st) == 0;
+    if (exists) {
+        // refuse read only files, even when running as root
+        if (access(target.c_str(), W_OK) == -1)
+            return -1;
+        if ((st.st_mode & 0222) == 0) {
+            errno = EACCES;
+            return -1;
+        }
+        // renaming over a file with several names would split its hard links
+        if (st.st_nlink > 1)
+            return writeInPlace(target, len) ? (ssize_t)len : -1;
+    }
+
+    // batch workers may save at the same time, so every temporary file gets its own name
+    static std::atomic<unsigned> tmp_count(0);
+    std::string tmp;
+    int fd;
+    do {
+        tmp = target + ".li-" + std::to_string(getpid()) + "-" + std::to_string(tmp_count++);
+        // 0644 is the standard permission for text files
+        fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+    } while (fd == -1 && errno == EEXIST);
+    if (fd == -1)
+        return -1;
+    bool ok = true;
+    if (exists) {
+        // an existing file keeps its owner, or is written in place if we can't give it back
+        if (fchown(fd, st.st_uid, st.st_gid) == -1) {
+            close(fd);
+            unlink(tmp.c_str());
+            return writeInPlace(target, len) ? (ssize_t)len : -1;
+        }
+        // and its permission, set after `fchown` which may clear the setuid bits
+        ok = fchmod(fd, st.st_mode & 07777) == 0;
     }
-    return buf;
+    ok = ok && writeRows(fd) && fsync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+    if (ok && rename(tmp.c_str(), target.c_str()) == 0)
+        return len;
+    int saved_errno = errno;
+    unlink(tmp.c_str());
+    errno = saved_errno;
+    return -1;
 }
 
 void editorSave() {
@@ -235,21 +453,11 @@ void editorSave() {
             return;
         }
     }
-    std::string buf = editorRowsToString();
-    int len = buf.size();
-    // O_RDWR: read & write. O_CREAT: create if not exist. 
-    // 0644 is the standard permission for text files
-    int fd = open(E.filename.c_str(), O_RDWR | O_CREAT, 0644);
-    if (fd != -1) {
-        if(ftruncate(fd, len) != -1) { // set the file's size to specified length
-            if(write(fd, buf.c_str(), len) == len) {
-                close(fd);
-                E.dirty = false;
-                editorSetStatusMessage(std::to_string(len) + " bytes written to disk");
-                return;
-            }
-        }
-        close(fd);
+    ssize_t len = editorWriteRows(E.filename);
+    if (len != -1) {
+        E.dirty = false;
+        editorSetStatusMessage(std::to_string(len) + " bytes written to disk");
+        return;
     }
     editorSetStatusMessage("Can't save! I/O error: " + std::string(strerror(errno)));
 }
@@ -313,7 +521,14 @@ void editorDrawStatusBar(abuf& ab) {
         (E.dirty? " (modified)" : "");
     int len = status.size();
     abAppend(ab, status.substr(0, std::min(len, E.screencols)));
-    std::string rstatus = std::to_string(E.cy+1) + "/" + std::to_string(E.rows.size()) + "  ";
+    // both lookups are O(log n) in the line index
+    long long offset = editorRowOffset(E.cy);
+    if (E.cy < (int)E.rows.size())
+        offset += std::min(E.cx, (int)E.rows[E.cy].chars.size());
+    long long total = editorRowOffset(E.rows.size());
+    std::string rstatus = "byte " + std::to_string(offset) + " (" + 
+        std::to_string(total ? offset * 100 / total : 0) + "%)  " + 
+        std::to_string(E.cy+1) + "/" + std::to_string(E.rows.size()) + "  ";
     while (len < E.screencols) {
         if (E.screencols - len == (int)rstatus.size()) {
             abAppend(ab, rstatus);
@@ -330,11 +545,14 @@ void editorDrawStatusBar(abuf& ab) {
 void editorDrawMessageBar(abuf& ab) {
     // clear the bar
     abAppend(ab, "\x1b[K");
-    abAppend(ab, E.status_msg);
+    // cut it to the screen, a wrapped message would scroll the whole screen
+    abAppend(ab, E.status_msg.substr(0, std::max(0, E.screencols)));
 }
 
 void editorRefreshScreen() {
     editorScroll();
+    if (E.batch)  // nothing to draw in batch mode
+        return;
 
     abuf ab = ABUF_INIT;
 
@@ -364,7 +582,7 @@ void editorSetStatusMessage(const std::string& msg) {
 
 /*** input ***/
 
-std::string editorPrompt(const std::string& prompt, void (*callback)(const std::string&, int)) {
+std::string editorPrompt(const std::string& prompt, void (*callback)(const std::string&, int), bool allow_empty) {
     std::string buf = "";
     while(true) {
         editorSetStatusMessage(prompt + buf);
@@ -380,7 +598,7 @@ std::string editorPrompt(const std::string& prompt, void (*callback)(const std::
             if (buf.size() != 0)
                 buf.pop_back();
         } else if (c == '\r') {
-            if (buf.size() != 0) {
+            if (buf.size() != 0 || allow_empty) {
                 editorSetStatusMessage("");
                 if (callback != nullptr)
                     callback(buf, c);
@@ -427,13 +645,17 @@ void editorMoveCursor(int key) {
 
 // wait for a keypress and handle it
 void editorProcessKeypress() {
-    static int quit_times = LI_QUIT_TIMES;
+    static thread_local int quit_times = LI_QUIT_TIMES;
     int c = editorReadKey();
     switch (c) {
         case '\r':  // use '\r' to get enter, don't know why...
             editorInsertNewline();
             break;
         case CTRL_KEY('c'):
+            if (E.batch) {  // batch mode, drop the unsaved changes of this file
+                E.quit = true;
+                break;
+            }
             if(E.dirty && quit_times > 0) {
                 editorSetStatusMessage("WARNING!!! File has unsaved changes. "
                     "Press Ctrl-C " + std::to_string(quit_times) + " more times to quit.");
@@ -468,7 +690,8 @@ void editorProcessKeypress() {
             E.cx = 0;
             break;
         case END_KEY:
-            E.cx = E.rows[E.cy].render.size();
+            if (E.cy < (int)E.rows.size())
+                E.cx = E.rows[E.cy].render.size();
             break;
         case PAGE_UP:
         case PAGE_DOWN:
@@ -480,12 +703,16 @@ void editorProcessKeypress() {
             break;
         }
         default:
-            if (short_cuts.find(c) != short_cuts.end()) {
-                short_cuts[c]();
+        {
+            // batch workers share the map, so only use `find`, which doesn't modify it
+            auto short_cut = short_cuts.find(c);
+            if (short_cut != short_cuts.end()) {
+                short_cut->second();
                 break;
             }
             editorInsertChar(c);
             break;
+        }
     }
     quit_times = LI_QUIT_TIMES;
 }
@@ -502,15 +729,27 @@ void initEditor() {
     E.row_offset = 0;
     E.col_offset = 0;
     E.dirty = false;
+    E.index.valid = 0;
+    E.newline = "\n";
+    E.batch = false;
+    E.keys = nullptr;
 }
 
 int main(int argc, char *argv[]) {
+    if (argc >= 2 && strcmp(argv[1], "--batch") == 0) {
+        if (argc < 4) {
+            fprintf(stderr, "usage: li --batch script file...\n");
+            return 1;
+        }
+        return editorBatch(argv[2], argc - 3, argv + 3);
+    }
     enableRawMode();
     initEditor();
-    if (argc >= 2)
-        editorOpen(argv[1]);
+    if (argc >= 2 && editorOpen(argv[1]) == -1)
+        die("fopen");
 
-    editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-C = quit");
+    editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-C = quit | Ctrl-F = find | Ctrl-R = replace | "
+        "Ctrl-G = go to line | Ctrl-O = go to byte");
 
     while(1) {
         editorRefreshScreen();
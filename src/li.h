@@ -19,12 +19,14 @@
 #include <stdlib.h>    // for `atexit`, `exit`
 #include <errno.h>     // for `errno`, `EAGAIN`
 #include <sys/ioctl.h> // get window size
-#include <fcntl.h>     // ftruncate
+#include <fcntl.h>     // open
+#include <sys/stat.h>  // stat, fchmod, fchown
 #include <string>
 #include <string.h>
 #include <vector>
 #include <algorithm>    // std::min
 #include <unordered_map>
+#include <atomic>
 
 /*** defines ***/
 const std::string LI_VERSION = "0.0.1";
@@ -33,6 +35,13 @@ const std::string LI_VERSION = "0.0.1";
 #define CTRL_KEY(k) ((k) & 0x1f)
 const int LI_TAB  = 4;
 const int LI_QUIT_TIMES = 1;
+// size of the chunks rows are streamed to disk in when saving
+const int LI_WRITE_CHUNK = 64 * 1024;
+// fake screen size used when running a script without a terminal
+const int LI_BATCH_ROWS = 24;
+const int LI_BATCH_COLS = 80;
+// replace all only spreads over threads if every thread gets at least this many rows
+const int LI_REPLACE_GRAIN = 4096;
 
 enum editorKey {
     BACKSPACE = 127,
@@ -50,6 +59,15 @@ enum editorKey {
 struct erow {
     std::string chars;
     std::string render;
+    // line terminator as on disk: "\n", "\r\n", or "" for a last line without one
+    std::string eol;
+};
+
+// Fenwick tree over the byte length of every row, newline included,
+// so rows and byte offsets can be mapped onto each other in O(log n)
+struct lineIndex {
+    std::vector<long long> tree;  // 1-based
+    int valid;  // tree[1..valid] is up to date, the rest is rebuilt when needed
 };
 
 /*** data ***/
@@ -63,19 +81,45 @@ struct editorConfig {
     int col_offset;
     std::string filename;
     std::vector<erow> rows;
+    std::string newline;  // terminator of new rows, the one of the first line of the file
     std::string status_msg;
     bool dirty;
+    lineIndex index;
+    // running a script from `li --batch`, without a terminal
+    bool batch;
+    // only set in batch mode: keys are read from here instead of stdin
+    const std::vector<int> *keys;
+    size_t key_pos;
+    bool quit;
 };
 
-extern editorConfig E;
+// every thread owns its editor, so batch workers can run side by side.
+// an add-on that spreads work over helper threads must not touch `E` on them,
+// where it is a different, empty editor: hand them the rows they work on instead
+extern thread_local editorConfig E;
 
 /*** prototypes ***/
 void editorSetStatusMessage(const std::string& msg);
 void editorRefreshScreen();
-std::string editorPrompt(const std::string& prompt, void (*callback)(const std::string&, int));
+int editorReadKey();
+void editorRenderRow(erow& row);
+void editorUpdateRow(int at);
+void editorIndexInvalidate(int at);
+long long editorRowOffset(int at);
+int editorOffsetToRow(long long offset, long long *col);
+void editorProcessKeypress();
+int editorOpen(const char *filename);
+ssize_t editorWriteRows(const std::string& filename);
+// `allow_empty` lets Enter accept an empty input, e.g. to replace with nothing
+std::string editorPrompt(const std::string& prompt, void (*callback)(const std::string&, int),
+                         bool allow_empty = false);
 
 /*** add-ons ***/
 void editorFind();
+void editorReplace();
+void editorGotoLine();
+void editorGotoOffset();
+int editorBatch(const char *script, int nfiles, char *files[]);
 extern std::unordered_map<int, void(*)()> short_cuts;
 
 extern std::string(*highlight)(const std::string&);